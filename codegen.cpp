@@ -1,17 +1,353 @@
 #include "codegen.h"
+#include <algorithm>
+#include <fstream>
 #include <sstream>
+#include <stdexcept>
 
-CodeGenerator::CodeGenerator() : labelCounter(0) {
+namespace {
+
+// "SIMPROF1", first word of a profile file
+const uint64_t PROFILE_MAGIC = 0x31464F52504D4953ULL;
+
+// Loops averaging at least this many iterations per entry get unrolled
+const uint64_t UNROLL_BY_2_TRIP_COUNT = 8;
+const uint64_t UNROLL_BY_4_TRIP_COUNT = 64;
+
+// Bodies longer than this many instructions are never duplicated
+const size_t MAX_UNROLL_BODY_LINES = 64;
+
+// A branch going the minority way at most this percent of the time is
+// predictable enough that a branch beats cmov
+const uint64_t PREDICTABLE_BRANCH_PERCENT = 10;
+
+// Largest stack frame generated code may use: half the usual 8 MiB stack
+// limit, leaving the rest for the expression stack. Well inside disp32.
+const long long MAX_FRAME_BYTES = 4LL << 20;
+
+// Vectorized loops keep reduction accumulators in the top vector registers
+// and broadcast loop invariants into the ones just below them
+const int VECTOR_REGISTER_COUNT = 16;
+const int MAX_VECTOR_REDUCTIONS = 4;
+
+bool isPowerOfTwo(unsigned long long value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+int log2Exact(unsigned long long value) {
+    int shift = 0;
+    while ((1ULL << shift) != value) {
+        shift++;
+    }
+    return shift;
+}
+
+// Multiplier and post-shift for signed 64-bit division by a constant,
+// following Hacker's Delight, section 10-1. Requires |divisor| >= 2.
+struct DivisionMagic {
+    long long multiplier;
+    int shift;
+};
+
+DivisionMagic computeDivisionMagic(long long divisor) {
+    const unsigned long long twoPow63 = 1ULL << 63;
+    unsigned long long absDivisor = divisor < 0 ? 0ULL - static_cast<unsigned long long>(divisor)
+                                                : static_cast<unsigned long long>(divisor);
+    unsigned long long t = twoPow63 + (static_cast<unsigned long long>(divisor) >> 63);
+    unsigned long long absNc = t - 1 - t % absDivisor;
+    int p = 63;
+    unsigned long long q1 = twoPow63 / absNc;
+    unsigned long long r1 = twoPow63 - q1 * absNc;
+    unsigned long long q2 = twoPow63 / absDivisor;
+    unsigned long long r2 = twoPow63 - q2 * absDivisor;
+    unsigned long long delta;
+    
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= absNc) {
+            q1++;
+            r1 -= absNc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= absDivisor) {
+            q2++;
+            r2 -= absDivisor;
+        }
+        delta = absDivisor - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    
+    unsigned long long magic = q2 + 1;
+    if (divisor < 0) {
+        magic = 0ULL - magic;
+    }
+    return {static_cast<long long>(magic), p - 64};
+}
+
+// FNV-1a over the program's AST (ignoring line numbers), stored in the
+// profile header so a profile is only applied to the program it came from
+const uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001B3ULL;
+
+void hashValue(uint64_t& hash, long long value) {
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((static_cast<unsigned long long>(value) >> (i * 8)) & 0xFF)) * FNV_PRIME;
+    }
+}
+
+void hashString(uint64_t& hash, const std::string& text) {
+    hashValue(hash, text.size());
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * FNV_PRIME;
+    }
+}
+
+void hashExpr(uint64_t& hash, const Expr& expr) {
+    if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
+        hashValue(hash, 1);
+        hashValue(hash, num->value);
+    } else if (auto id = dynamic_cast<const IdentifierExpr*>(&expr)) {
+        hashValue(hash, 2);
+        hashString(hash, id->name);
+    } else if (auto index = dynamic_cast<const IndexExpr*>(&expr)) {
+        hashValue(hash, 3);
+        hashString(hash, index->name);
+        hashExpr(hash, *index->index);
+    } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+        hashValue(hash, 4);
+        hashValue(hash, static_cast<long long>(bin->op));
+        hashExpr(hash, *bin->left);
+        hashExpr(hash, *bin->right);
+    }
+}
+
+void hashStmt(uint64_t& hash, const Stmt* stmt) {
+    if (!stmt) {
+        hashValue(hash, 0);
+    } else if (auto let = dynamic_cast<const LetStmt*>(stmt)) {
+        hashValue(hash, 11);
+        hashString(hash, let->name);
+        hashExpr(hash, *let->value);
+    } else if (auto arrayLet = dynamic_cast<const ArrayLetStmt*>(stmt)) {
+        hashValue(hash, 12);
+        hashString(hash, arrayLet->name);
+        hashValue(hash, arrayLet->size);
+    } else if (auto indexLet = dynamic_cast<const IndexLetStmt*>(stmt)) {
+        hashValue(hash, 13);
+        hashString(hash, indexLet->name);
+        hashExpr(hash, *indexLet->index);
+        hashExpr(hash, *indexLet->value);
+    } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(stmt)) {
+        hashValue(hash, 14);
+        hashExpr(hash, *exprStmt->expr);
+    } else if (auto block = dynamic_cast<const BlockStmt*>(stmt)) {
+        hashValue(hash, 15);
+        hashValue(hash, block->statements.size());
+        for (const auto& s : block->statements) {
+            hashStmt(hash, s.get());
+        }
+    } else if (auto ifStmt = dynamic_cast<const IfStmt*>(stmt)) {
+        hashValue(hash, 16);
+        hashExpr(hash, *ifStmt->condition);
+        hashStmt(hash, ifStmt->thenBranch.get());
+        hashStmt(hash, ifStmt->elseBranch.get());
+    } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(stmt)) {
+        hashValue(hash, 17);
+        hashExpr(hash, *whileStmt->condition);
+        hashStmt(hash, whileStmt->body.get());
+    }
+}
+
+std::string hexWord(uint64_t value) {
+    std::ostringstream out;
+    out << "0x" << std::hex << std::uppercase << value;
+    return out.str();
+}
+
+// Comparison with its operands swapped: `c < x` is `x > c`.
+TokenType swapComparison(TokenType op) {
+    switch (op) {
+        case TokenType::LESS: return TokenType::GREATER;
+        case TokenType::GREATER: return TokenType::LESS;
+        default: return op;
+    }
+}
+
+bool isComparison(TokenType op) {
+    return op == TokenType::EQUAL || op == TokenType::LESS || op == TokenType::GREATER;
+}
+
+// Condition-code suffix for jcc/cmovcc/setcc after `cmp left, right`
+std::string conditionCode(TokenType op, bool negate) {
+    switch (op) {
+        case TokenType::EQUAL: return negate ? "ne" : "e";
+        case TokenType::LESS: return negate ? "ge" : "l";
+        case TokenType::GREATER: return negate ? "le" : "g";
+        default: throw std::runtime_error("Unsupported comparison operator");
+    }
+}
+
+// The single LetStmt in stmt, looking through one-statement blocks
+const LetStmt* singleLet(const Stmt* stmt) {
+    while (auto block = dynamic_cast<const BlockStmt*>(stmt)) {
+        if (block->statements.size() != 1) {
+            return nullptr;
+        }
+        stmt = block->statements[0].get();
+    }
+    return dynamic_cast<const LetStmt*>(stmt);
+}
+
+// True for cheap values that are safe to evaluate even when their branch
+// is not taken: leaves, or one operator over leaves that cannot fault.
+bool isSpeculatableValue(const Expr& expr) {
+    if (dynamic_cast<const NumberExpr*>(&expr) || dynamic_cast<const IdentifierExpr*>(&expr)) {
+        return true;
+    }
+    auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+    if (!bin) {
+        return false;
+    }
+    bool leftIsLeaf = dynamic_cast<const NumberExpr*>(bin->left.get()) ||
+                      dynamic_cast<const IdentifierExpr*>(bin->left.get());
+    auto divisor = dynamic_cast<const NumberExpr*>(bin->right.get());
+    bool rightIsLeaf = divisor || dynamic_cast<const IdentifierExpr*>(bin->right.get());
+    if (bin->op == TokenType::DIVIDE && (!divisor || divisor->value == 0)) {
+        return false;
+    }
+    return leftIsLeaf && rightIsLeaf;
+}
+
+// True for `i + 1` or `1 + i`
+bool isIncrementOf(const Expr& expr, const std::string& counter) {
+    auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+    if (!bin || bin->op != TokenType::PLUS) {
+        return false;
+    }
+    auto id = dynamic_cast<const IdentifierExpr*>(bin->left.get());
+    auto one = dynamic_cast<const NumberExpr*>(bin->right.get());
+    if (!id) {
+        id = dynamic_cast<const IdentifierExpr*>(bin->right.get());
+        one = dynamic_cast<const NumberExpr*>(bin->left.get());
+    }
+    return id && one && id->name == counter && one->value == 1;
+}
+
+// The e in `let s = s + e;` or `let s = e + s;`, or nullptr
+const Expr* reductionTerm(const LetStmt& stmt) {
+    auto bin = dynamic_cast<const BinaryExpr*>(stmt.value.get());
+    if (!bin || bin->op != TokenType::PLUS) {
+        return nullptr;
+    }
+    auto left = dynamic_cast<const IdentifierExpr*>(bin->left.get());
+    if (left && left->name == stmt.name) {
+        return bin->right.get();
+    }
+    auto right = dynamic_cast<const IdentifierExpr*>(bin->right.get());
+    if (right && right->name == stmt.name) {
+        return bin->left.get();
+    }
+    return nullptr;
+}
+
+// The value computed per lane by a vectorizable statement
+const Expr& vectorValue(const Stmt& stmt) {
+    if (auto store = dynamic_cast<const IndexLetStmt*>(&stmt)) {
+        return *store->value;
+    }
+    return *reductionTerm(static_cast<const LetStmt&>(stmt));
+}
+
+// Registers generateVectorExpr uses from its base register upward.
+// Invariant leaves live in their own registers and need none; a 64-bit
+// multiply needs two scratch registers beside its operands.
+int vectorRegistersNeeded(const Expr& expr) {
+    if (dynamic_cast<const IndexExpr*>(&expr)) {
+        return 1;
+    }
+    auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+    if (!bin) {
+        return 0;
+    }
+    int needed = std::max(vectorRegistersNeeded(*bin->left), 1 + vectorRegistersNeeded(*bin->right));
+    return std::max(needed, bin->op == TokenType::MULTIPLY ? 4 : 1);
+}
+
+// True if a and b are the same constant or the same scalar
+bool sameInvariant(const Expr& a, const Expr& b) {
+    auto numA = dynamic_cast<const NumberExpr*>(&a);
+    auto numB = dynamic_cast<const NumberExpr*>(&b);
+    if (numA || numB) {
+        return numA && numB && numA->value == numB->value;
+    }
+    return static_cast<const IdentifierExpr&>(a).name == static_cast<const IdentifierExpr&>(b).name;
+}
+
+// Adds the constants and scalars a vectorizable expression reads to
+// invariants, skipping ones already there
+void collectVectorInvariants(const Expr& expr, std::vector<const Expr*>& invariants) {
+    if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+        collectVectorInvariants(*bin->left, invariants);
+        collectVectorInvariants(*bin->right, invariants);
+        return;
+    }
+    if (dynamic_cast<const IndexExpr*>(&expr)) {
+        return;
+    }
+    for (const Expr* invariant : invariants) {
+        if (sameInvariant(*invariant, expr)) {
+            return;
+        }
+    }
+    invariants.push_back(&expr);
+}
+
+std::string vectorRegister(int reg, int width) {
+    return (width == 4 ? "ymm" : "xmm") + std::to_string(reg);
+}
+
+} // namespace
+
+CodeGenerator::CodeGenerator()
+    : frameSlots(0), labelCounter(0), usesCpuDispatch(false), currentLine(0), markedLine(0),
+      profileMode(ProfileMode::NONE), profileCounterCount(0), profileFingerprint(FNV_OFFSET_BASIS) {
     // Initialize assembly with prologue
     assembly.push_back("section .text");
     assembly.push_back("global _start");
     assembly.push_back("_start:");
     assembly.push_back("    push rbp");
     assembly.push_back("    mov rbp, rsp");
+    frameSetupIndex = assembly.size();
 }
 
-std::string CodeGenerator::newLabel() {
-    return "L" + std::to_string(labelCounter++);
+void CodeGenerator::setProfileMode(ProfileMode mode, const std::string& path) {
+    profileMode = mode;
+    profilePath = path;
+}
+
+// Labels name their role and source line, e.g. while_body_line12_3, so
+// profilers attribute samples in each block to the statement it came from.
+std::string CodeGenerator::newLabel(const std::string& role) {
+    std::string label = role + "_";
+    if (currentLine > 0) {
+        label += "line" + std::to_string(currentLine) + "_";
+    }
+    return label + std::to_string(labelCounter++);
+}
+
+void CodeGenerator::setSourceFile(const std::string& path) {
+    sourceFile = path;
+}
+
+// Maps the following instructions to currentLine in the DWARF line table
+// nasm builds with -g. Nothing is emitted without a source file.
+void CodeGenerator::generateLineMarker() {
+    if (sourceFile.empty() || currentLine <= 0 || currentLine == markedLine) {
+        return;
+    }
+    assembly.push_back("%line " + std::to_string(currentLine) + "+0 " + sourceFile);
+    markedLine = currentLine;
 }
 
 void CodeGenerator::generateExpr(const Expr& expr) {
@@ -19,6 +355,8 @@ void CodeGenerator::generateExpr(const Expr& expr) {
         generateNumberExpr(*num);
     } else if (auto id = dynamic_cast<const IdentifierExpr*>(&expr)) {
         generateIdentifierExpr(*id);
+    } else if (auto index = dynamic_cast<const IndexExpr*>(&expr)) {
+        generateIndexExpr(*index);
     } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
         generateBinaryExpr(*bin);
     }
@@ -29,14 +367,52 @@ void CodeGenerator::generateNumberExpr(const NumberExpr& expr) {
 }
 
 void CodeGenerator::generateIdentifierExpr(const IdentifierExpr& expr) {
-    auto it = variables.find(expr.name);
+    assembly.push_back("    push " + variableOperand(expr.name));
+}
+
+std::string CodeGenerator::variableOperand(const std::string& name) const {
+    auto it = variables.find(name);
     if (it == variables.end()) {
-        throw std::runtime_error("Undefined variable: " + expr.name);
+        throw std::runtime_error("Undefined variable: " + name);
+    }
+    return "QWORD [rbp - " + std::to_string(it->second * 8) + "]";
+}
+
+const CodeGenerator::ArrayInfo& CodeGenerator::arrayInfo(const std::string& name) const {
+    auto it = arrays.find(name);
+    if (it == arrays.end()) {
+        throw std::runtime_error("Undefined array: " + name);
+    }
+    return it->second;
+}
+
+// Memory operand for name[indexRegister]
+std::string CodeGenerator::elementAddress(const std::string& name, const std::string& indexRegister) const {
+    return "[rbp + " + indexRegister + "*8 - " + std::to_string(arrayInfo(name).firstSlot * 8) + "]";
+}
+
+void CodeGenerator::generateIndexExpr(const IndexExpr& expr) {
+    const ArrayInfo& array = arrayInfo(expr.name);
+    
+    if (auto constant = dynamic_cast<const NumberExpr*>(expr.index.get())) {
+        if (constant->value < 0 || constant->value >= array.size) {
+            throw std::runtime_error("Index " + std::to_string(constant->value) + " out of bounds for " + expr.name);
+        }
+        long long slot = array.firstSlot - constant->value;
+        assembly.push_back("    push QWORD [rbp - " + std::to_string(slot * 8) + "]");
+        return;
     }
-    assembly.push_back("    push QWORD [rbp - " + std::to_string(it->second * 8) + "]");
+    
+    generateExpr(*expr.index);
+    assembly.push_back("    pop rax");
+    assembly.push_back("    push QWORD " + elementAddress(expr.name, "rax"));
 }
 
 void CodeGenerator::generateBinaryExpr(const BinaryExpr& expr) {
+    if (generateImmediateBinaryExpr(expr)) {
+        return;
+    }
+    
     generateExpr(*expr.left);
     generateExpr(*expr.right);
     
@@ -79,9 +455,168 @@ void CodeGenerator::generateBinaryExpr(const BinaryExpr& expr) {
     assembly.push_back("    push rax");
 }
 
+// Selects immediate-operand forms when one side is a constant, so the
+// constant never goes through the stack. Returns false if the general
+// stack-based lowering is needed instead.
+bool CodeGenerator::generateImmediateBinaryExpr(const BinaryExpr& expr) {
+    TokenType op = expr.op;
+    const Expr* operand = expr.left.get();
+    auto constant = dynamic_cast<const NumberExpr*>(expr.right.get());
+    
+    if (!constant) {
+        // Only commutative operators and comparisons can take the constant
+        // from the left.
+        constant = dynamic_cast<const NumberExpr*>(expr.left.get());
+        if (!constant || op == TokenType::MINUS || op == TokenType::DIVIDE) {
+            return false;
+        }
+        operand = expr.right.get();
+        op = swapComparison(op);
+    }
+    
+    long long value = constant->value;
+    if (op == TokenType::DIVIDE && value == 0) {
+        return false; // Keep the hardware fault of a real idiv
+    }
+    
+    generateExpr(*operand);
+    assembly.push_back("    pop rax");
+    
+    std::string immediate = std::to_string(value);
+    switch (op) {
+        case TokenType::PLUS:
+            if (value != 0) {
+                assembly.push_back("    add rax, " + immediate);
+            }
+            break;
+        case TokenType::MINUS:
+            if (value != 0) {
+                assembly.push_back("    sub rax, " + immediate);
+            }
+            break;
+        case TokenType::MULTIPLY:
+            generateMultiplyByConstant(value);
+            break;
+        case TokenType::DIVIDE:
+            generateDivideByConstant(value);
+            break;
+        case TokenType::EQUAL:
+            assembly.push_back("    cmp rax, " + immediate);
+            assembly.push_back("    sete al");
+            assembly.push_back("    movzx rax, al");
+            break;
+        case TokenType::LESS:
+            assembly.push_back("    cmp rax, " + immediate);
+            assembly.push_back("    setl al");
+            assembly.push_back("    movzx rax, al");
+            break;
+        case TokenType::GREATER:
+            assembly.push_back("    cmp rax, " + immediate);
+            assembly.push_back("    setg al");
+            assembly.push_back("    movzx rax, al");
+            break;
+        default:
+            throw std::runtime_error("Unsupported binary operator");
+    }
+    
+    assembly.push_back("    push rax");
+    return true;
+}
+
+// rax = rax * multiplier, using shifts and lea where they beat imul.
+void CodeGenerator::generateMultiplyByConstant(long long multiplier) {
+    if (multiplier == 0) {
+        assembly.push_back("    xor eax, eax");
+        return;
+    }
+    if (multiplier == 1) {
+        return;
+    }
+    if (multiplier == -1) {
+        assembly.push_back("    neg rax");
+        return;
+    }
+    
+    // Split into scale * 2^shift where scale is 1, 3, 5 or 9, each of
+    // which is a single shl or lea.
+    if (multiplier > 0) {
+        unsigned long long remaining = static_cast<unsigned long long>(multiplier);
+        int shift = 0;
+        while ((remaining & 1) == 0) {
+            remaining >>= 1;
+            shift++;
+        }
+        if (remaining == 1 || remaining == 3 || remaining == 5 || remaining == 9) {
+            if (remaining != 1) {
+                assembly.push_back("    lea rax, [rax + rax*" + std::to_string(remaining - 1) + "]");
+            }
+            if (shift > 0) {
+                assembly.push_back("    shl rax, " + std::to_string(shift));
+            }
+            return;
+        }
+    }
+    
+    assembly.push_back("    imul rax, rax, " + std::to_string(multiplier));
+}
+
+// rax = rax / divisor with C truncation semantics, without idiv.
+// The divisor must be non-zero. Clobbers rcx and rdx.
+void CodeGenerator::generateDivideByConstant(long long divisor) {
+    if (divisor == 1) {
+        return;
+    }
+    if (divisor == -1) {
+        assembly.push_back("    neg rax");
+        return;
+    }
+    
+    unsigned long long absDivisor = divisor < 0 ? 0ULL - static_cast<unsigned long long>(divisor)
+                                                : static_cast<unsigned long long>(divisor);
+    if (isPowerOfTwo(absDivisor)) {
+        // Bias negative dividends by 2^k - 1 so the arithmetic shift
+        // rounds toward zero.
+        int shift = log2Exact(absDivisor);
+        assembly.push_back("    mov rdx, rax");
+        assembly.push_back("    sar rdx, 63");
+        assembly.push_back("    shr rdx, " + std::to_string(64 - shift));
+        assembly.push_back("    add rax, rdx");
+        assembly.push_back("    sar rax, " + std::to_string(shift));
+        if (divisor < 0) {
+            assembly.push_back("    neg rax");
+        }
+        return;
+    }
+    
+    DivisionMagic magic = computeDivisionMagic(divisor);
+    assembly.push_back("    mov rcx, rax");
+    assembly.push_back("    mov rax, " + std::to_string(magic.multiplier));
+    assembly.push_back("    imul rcx"); // rdx = high 64 bits of magic * n
+    if (divisor > 0 && magic.multiplier < 0) {
+        assembly.push_back("    add rdx, rcx");
+    } else if (divisor < 0 && magic.multiplier > 0) {
+        assembly.push_back("    sub rdx, rcx");
+    }
+    if (magic.shift > 0) {
+        assembly.push_back("    sar rdx, " + std::to_string(magic.shift));
+    }
+    // Add one when the quotient is negative to round toward zero.
+    assembly.push_back("    mov rax, rdx");
+    assembly.push_back("    shr rax, 63");
+    assembly.push_back("    add rax, rdx");
+}
+
 void CodeGenerator::generateStmt(const Stmt& stmt) {
+    int enclosingLine = currentLine;
+    currentLine = stmt.line;
+    generateLineMarker();
+    
     if (auto let = dynamic_cast<const LetStmt*>(&stmt)) {
         generateLetStmt(*let);
+    } else if (auto arrayLet = dynamic_cast<const ArrayLetStmt*>(&stmt)) {
+        generateArrayLetStmt(*arrayLet);
+    } else if (auto indexLet = dynamic_cast<const IndexLetStmt*>(&stmt)) {
+        generateIndexLetStmt(*indexLet);
     } else if (auto expr = dynamic_cast<const ExprStmt*>(&stmt)) {
         generateExprStmt(*expr);
     } else if (auto block = dynamic_cast<const BlockStmt*>(&stmt)) {
@@ -91,17 +626,80 @@ void CodeGenerator::generateStmt(const Stmt& stmt) {
     } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
         generateWhileStmt(*whileStmt);
     }
+    
+    currentLine = enclosingLine;
 }
 
 void CodeGenerator::generateLetStmt(const LetStmt& stmt) {
+    if (arrays.count(stmt.name)) {
+        throw std::runtime_error("Cannot assign to array: " + stmt.name);
+    }
+    
     generateExpr(*stmt.value);
     
-    int offset = variables.size() + 1;
-    variables[stmt.name] = offset;
+    // Re-binding an existing name stores to its slot, so loop bodies can
+    // update the variables their conditions read.
+    long long offset;
+    auto it = variables.find(stmt.name);
+    if (it != variables.end()) {
+        offset = it->second;
+    } else {
+        offset = allocateFrameSlots(1, stmt.name);
+        variables[stmt.name] = offset;
+    }
     
     assembly.push_back("    pop QWORD [rbp - " + std::to_string(offset * 8) + "]");
 }
 
+// Reserves count more 8-byte slots below rbp for name and returns the
+// deepest one
+long long CodeGenerator::allocateFrameSlots(long long count, const std::string& name) {
+    if ((frameSlots + count) * 8 > MAX_FRAME_BYTES) {
+        throw std::runtime_error("Stack frame would exceed " + std::to_string(MAX_FRAME_BYTES) +
+                                 " bytes allocating " + name);
+    }
+    frameSlots += count;
+    return frameSlots;
+}
+
+void CodeGenerator::generateArrayLetStmt(const ArrayLetStmt& stmt) {
+    if (variables.count(stmt.name)) {
+        throw std::runtime_error("Already declared as a variable: " + stmt.name);
+    }
+    
+    // Redeclaring with the same size just clears the existing storage
+    auto it = arrays.find(stmt.name);
+    if (it == arrays.end()) {
+        long long firstSlot = allocateFrameSlots(stmt.size, stmt.name);
+        it = arrays.emplace(stmt.name, ArrayInfo{firstSlot, stmt.size}).first;
+    } else if (it->second.size != stmt.size) {
+        throw std::runtime_error("Array redeclared with a different size: " + stmt.name);
+    }
+    
+    assembly.push_back("    lea rdi, [rbp - " + std::to_string(it->second.firstSlot * 8) + "]");
+    assembly.push_back("    mov rcx, " + std::to_string(stmt.size));
+    assembly.push_back("    xor eax, eax");
+    assembly.push_back("    rep stosq");
+}
+
+void CodeGenerator::generateIndexLetStmt(const IndexLetStmt& stmt) {
+    const ArrayInfo& array = arrayInfo(stmt.name);
+    generateExpr(*stmt.value);
+    
+    if (auto constant = dynamic_cast<const NumberExpr*>(stmt.index.get())) {
+        if (constant->value < 0 || constant->value >= array.size) {
+            throw std::runtime_error("Index " + std::to_string(constant->value) + " out of bounds for " + stmt.name);
+        }
+        long long slot = array.firstSlot - constant->value;
+        assembly.push_back("    pop QWORD [rbp - " + std::to_string(slot * 8) + "]");
+        return;
+    }
+    
+    generateExpr(*stmt.index);
+    assembly.push_back("    pop rax");
+    assembly.push_back("    pop QWORD " + elementAddress(stmt.name, "rax"));
+}
+
 void CodeGenerator::generateExprStmt(const ExprStmt& stmt) {
     generateExpr(*stmt.expr);
     assembly.push_back("    pop rax"); // Discard result
@@ -114,18 +712,48 @@ void CodeGenerator::generateBlockStmt(const BlockStmt& stmt) {
 }
 
 void CodeGenerator::generateIfStmt(const IfStmt& stmt) {
-    std::string elseLabel = newLabel();
-    std::string endLabel = newLabel();
+    // Instrumented builds keep the branch so both edges get counted
+    if (profileMode != ProfileMode::GENERATE && generateConditionalMove(stmt)) {
+        return;
+    }
     
-    generateExpr(*stmt.condition);
-    assembly.push_back("    pop rax");
-    assembly.push_back("    test rax, rax");
-    assembly.push_back("    jz " + elseLabel);
+    std::string elseLabel = newLabel("if_else");
+    std::string endLabel = newLabel("if_end");
+    int counter = profileCounter(stmt);
+    
+    if (profileMode == ProfileMode::USE) {
+        uint64_t thenCount = profileCounts[counter];
+        uint64_t elseCount = profileCounts[counter + 1];
+        
+        // Let the hotter branch fall through and move the colder one
+        // out of line, after the exit syscall.
+        if (elseCount > thenCount) {
+            std::string thenLabel = newLabel("if_then");
+            generateBranch(*stmt.condition, thenLabel, true);
+            if (stmt.elseBranch) {
+                generateStmt(*stmt.elseBranch);
+            }
+            assembly.push_back(endLabel + ":");
+            generateColdBlock(thenLabel, stmt.thenBranch.get(), endLabel);
+            return;
+        }
+        if (stmt.elseBranch) {
+            generateBranch(*stmt.condition, elseLabel, false);
+            generateStmt(*stmt.thenBranch);
+            assembly.push_back(endLabel + ":");
+            generateColdBlock(elseLabel, stmt.elseBranch.get(), endLabel);
+            return;
+        }
+    }
     
+    generateBranch(*stmt.condition, elseLabel, false);
+    
+    generateCounterIncrement(counter);
     generateStmt(*stmt.thenBranch);
     assembly.push_back("    jmp " + endLabel);
     
     assembly.push_back(elseLabel + ":");
+    generateCounterIncrement(counter + 1);
     if (stmt.elseBranch) {
         generateStmt(*stmt.elseBranch);
     }
@@ -134,27 +762,596 @@ void CodeGenerator::generateIfStmt(const IfStmt& stmt) {
 }
 
 void CodeGenerator::generateWhileStmt(const WhileStmt& stmt) {
-    std::string startLabel = newLabel();
-    std::string endLabel = newLabel();
+    int counter = profileCounter(stmt);
+    
+    // Whole vectors of iterations first; the loop below then runs the
+    // scalar remainder.
+    VectorLoop vectorLoop;
+    if (matchVectorLoop(stmt, vectorLoop)) {
+        generateVectorLoop(vectorLoop);
+    }
+    
+    if (profileMode == ProfileMode::USE) {
+        uint64_t entries = profileCounts[counter];
+        uint64_t backEdges = profileCounts[counter + 1];
+        
+        if (backEdges > 0 && backEdges >= entries) {
+            uint64_t tripCount = backEdges / (entries > 0 ? entries : 1);
+            int unrollFactor = 1;
+            if (tripCount >= UNROLL_BY_4_TRIP_COUNT) {
+                unrollFactor = 4;
+            } else if (tripCount >= UNROLL_BY_2_TRIP_COUNT) {
+                unrollFactor = 2;
+            }
+            generateRotatedWhileStmt(stmt, unrollFactor);
+            return;
+        }
+    }
     
+    std::string startLabel = newLabel("while_cond");
+    std::string endLabel = newLabel("while_end");
+    
+    generateCounterIncrement(counter);
     assembly.push_back(startLabel + ":");
-    generateExpr(*stmt.condition);
-    assembly.push_back("    pop rax");
-    assembly.push_back("    test rax, rax");
-    assembly.push_back("    jz " + endLabel);
+    generateBranch(*stmt.condition, endLabel, false);
     
     generateStmt(*stmt.body);
+    generateLineMarker();
+    generateCounterIncrement(counter + 1);
     assembly.push_back("    jmp " + startLabel);
     
     assembly.push_back(endLabel + ":");
 }
 
+// Bottom-tested layout for loops the profile shows iterating: the
+// back-edge is the only taken branch per iteration. With unrollFactor > 1
+// the body is repeated, each copy guarded by its own exit test.
+void CodeGenerator::generateRotatedWhileStmt(const WhileStmt& stmt, int unrollFactor) {
+    std::string bodyLabel = newLabel("while_body");
+    std::string conditionLabel = newLabel("while_cond");
+    std::string endLabel = newLabel("while_end");
+    
+    assembly.push_back("    jmp " + conditionLabel);
+    assembly.push_back(bodyLabel + ":");
+    for (int copy = 0; copy < unrollFactor; copy++) {
+        if (copy > 0) {
+            generateLineMarker();
+            generateBranch(*stmt.condition, endLabel, false);
+        }
+        size_t bodyStart = assembly.size();
+        generateStmt(*stmt.body);
+        if (assembly.size() - bodyStart > MAX_UNROLL_BODY_LINES) {
+            break;
+        }
+    }
+    
+    generateLineMarker();
+    assembly.push_back(conditionLabel + ":");
+    generateBranch(*stmt.condition, bodyLabel, true);
+    assembly.push_back(endLabel + ":");
+}
+
+bool CodeGenerator::matchVectorLoop(const WhileStmt& stmt, VectorLoop& loop) const {
+    auto condition = dynamic_cast<const BinaryExpr*>(stmt.condition.get());
+    auto body = dynamic_cast<const BlockStmt*>(stmt.body.get());
+    if (!condition || condition->op != TokenType::LESS || !body || body->statements.size() < 2) {
+        return false;
+    }
+    
+    auto counter = dynamic_cast<const IdentifierExpr*>(condition->left.get());
+    if (!counter || !variables.count(counter->name)) {
+        return false;
+    }
+    loop.counter = counter->name;
+    loop.bound = condition->right.get();
+    loop.statements.clear();
+    loop.invariants.clear();
+    loop.reductionCount = 0;
+    
+    auto increment = dynamic_cast<const LetStmt*>(body->statements.back().get());
+    if (!increment || increment->name != loop.counter || !isIncrementOf(*increment->value, loop.counter)) {
+        return false;
+    }
+    
+    // Everything but the increment must be a store to a[i] or a reduction
+    // into a distinct variable.
+    std::vector<std::string> accumulators;
+    for (size_t k = 0; k + 1 < body->statements.size(); k++) {
+        const Stmt* s = body->statements[k].get();
+        if (auto store = dynamic_cast<const IndexLetStmt*>(s)) {
+            auto index = dynamic_cast<const IdentifierExpr*>(store->index.get());
+            if (!index || index->name != loop.counter || !arrays.count(store->name)) {
+                return false;
+            }
+        } else if (auto let = dynamic_cast<const LetStmt*>(s)) {
+            if (!reductionTerm(*let) || !variables.count(let->name) || let->name == loop.counter ||
+                std::find(accumulators.begin(), accumulators.end(), let->name) != accumulators.end()) {
+                return false;
+            }
+            accumulators.push_back(let->name);
+        } else {
+            return false;
+        }
+        loop.statements.push_back(s);
+    }
+    loop.reductionCount = accumulators.size();
+    if (loop.reductionCount > MAX_VECTOR_REDUCTIONS) {
+        return false;
+    }
+    
+    // The bound and every value may only read arrays at [i], constants and
+    // scalars the body never writes.
+    auto boundVariable = dynamic_cast<const IdentifierExpr*>(loop.bound);
+    if (!dynamic_cast<const NumberExpr*>(loop.bound) && !(boundVariable && isVectorizableExpr(*boundVariable, loop))) {
+        return false;
+    }
+    for (const Stmt* s : loop.statements) {
+        const Expr& value = vectorValue(*s);
+        if (!isVectorizableExpr(value, loop)) {
+            return false;
+        }
+        collectVectorInvariants(value, loop.invariants);
+    }
+    int freeRegisters = VECTOR_REGISTER_COUNT - loop.reductionCount - static_cast<int>(loop.invariants.size());
+    for (const Stmt* s : loop.statements) {
+        if (vectorRegistersNeeded(vectorValue(*s)) > freeRegisters) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CodeGenerator::isVectorizableExpr(const Expr& expr, const VectorLoop& loop) const {
+    if (dynamic_cast<const NumberExpr*>(&expr)) {
+        return true;
+    }
+    if (auto id = dynamic_cast<const IdentifierExpr*>(&expr)) {
+        if (id->name == loop.counter || !variables.count(id->name)) {
+            return false;
+        }
+        for (const Stmt* s : loop.statements) {
+            auto let = dynamic_cast<const LetStmt*>(s);
+            if (let && let->name == id->name) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (auto index = dynamic_cast<const IndexExpr*>(&expr)) {
+        auto id = dynamic_cast<const IdentifierExpr*>(index->index.get());
+        return id && id->name == loop.counter && arrays.count(index->name);
+    }
+    if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+        return (bin->op == TokenType::PLUS || bin->op == TokenType::MINUS || bin->op == TokenType::MULTIPLY) &&
+               isVectorizableExpr(*bin->left, loop) && isVectorizableExpr(*bin->right, loop);
+    }
+    return false;
+}
+
+// Runs the matched loop a whole vector at a time while at least one full
+// vector of iterations remains, using AVX2 (4 lanes) when the CPU has it
+// and SSE2 (2 lanes) otherwise. Leaves the counter at the first iteration
+// not yet run.
+void CodeGenerator::generateVectorLoop(const VectorLoop& loop) {
+    std::string sseLabel = newLabel("vector_sse2");
+    std::string doneLabel = newLabel("vector_done");
+    usesCpuDispatch = true;
+    
+    // rcx holds the counter and rdx the bound throughout
+    assembly.push_back("    mov rcx, " + variableOperand(loop.counter));
+    if (auto constant = dynamic_cast<const NumberExpr*>(loop.bound)) {
+        assembly.push_back("    mov rdx, " + std::to_string(constant->value));
+    } else {
+        assembly.push_back("    mov rdx, " + variableOperand(static_cast<const IdentifierExpr*>(loop.bound)->name));
+    }
+    
+    assembly.push_back("    cmp BYTE [rel __cpu_has_avx2], 0");
+    assembly.push_back("    je " + sseLabel);
+    generateVectorBody(loop, 4);
+    assembly.push_back("    vzeroupper");
+    assembly.push_back("    jmp " + doneLabel);
+    
+    assembly.push_back(sseLabel + ":");
+    generateVectorBody(loop, 2);
+    
+    assembly.push_back(doneLabel + ":");
+    assembly.push_back("    mov " + variableOperand(loop.counter) + ", rcx");
+}
+
+void CodeGenerator::generateVectorBody(const VectorLoop& loop, int width) {
+    bool avx = width == 4;
+    std::string loopLabel = newLabel("vector_loop");
+    std::string exitLabel = newLabel("vector_exit");
+    std::string lanes = std::to_string(width);
+    
+    int accumulator = VECTOR_REGISTER_COUNT;
+    for (int k = 0; k < loop.reductionCount; k++) {
+        std::string acc = vectorRegister(--accumulator, width);
+        assembly.push_back(avx ? "    vpxor " + acc + ", " + acc + ", " + acc : "    pxor " + acc + ", " + acc);
+    }
+    
+    // Broadcast each invariant to every lane of its register once, below
+    // the accumulators
+    int invariantRegister = accumulator - static_cast<int>(loop.invariants.size());
+    for (const Expr* invariant : loop.invariants) {
+        if (auto num = dynamic_cast<const NumberExpr*>(invariant)) {
+            assembly.push_back("    mov rax, " + std::to_string(num->value));
+        } else {
+            assembly.push_back("    mov rax, " + variableOperand(static_cast<const IdentifierExpr*>(invariant)->name));
+        }
+        std::string r = vectorRegister(invariantRegister, width);
+        std::string low = vectorRegister(invariantRegister, 2);
+        if (avx) {
+            assembly.push_back("    vmovq " + low + ", rax");
+            assembly.push_back("    vpbroadcastq " + r + ", " + low);
+        } else {
+            assembly.push_back("    movq " + r + ", rax");
+            assembly.push_back("    punpcklqdq " + r + ", " + r);
+        }
+        invariantRegister++;
+    }
+    
+    assembly.push_back(loopLabel + ":");
+    assembly.push_back("    lea rax, [rcx + " + lanes + "]");
+    assembly.push_back("    cmp rax, rdx");
+    assembly.push_back("    jg " + exitLabel);
+    
+    accumulator = VECTOR_REGISTER_COUNT;
+    for (const Stmt* s : loop.statements) {
+        std::string result = generateVectorExpr(vectorValue(*s), loop, 0, width);
+        if (auto store = dynamic_cast<const IndexLetStmt*>(s)) {
+            assembly.push_back(std::string(avx ? "    vmovdqu " : "    movdqu ") +
+                               elementAddress(store->name, "rcx") + ", " + result);
+        } else {
+            std::string acc = vectorRegister(--accumulator, width);
+            assembly.push_back(avx ? "    vpaddq " + acc + ", " + acc + ", " + result
+                                   : "    paddq " + acc + ", " + result);
+        }
+    }
+    
+    assembly.push_back("    add rcx, " + lanes);
+    assembly.push_back("    jmp " + loopLabel);
+    assembly.push_back(exitLabel + ":");
+    
+    // Sum each accumulator's lanes into its variable
+    accumulator = VECTOR_REGISTER_COUNT;
+    for (const Stmt* s : loop.statements) {
+        auto let = dynamic_cast<const LetStmt*>(s);
+        if (!let) {
+            continue;
+        }
+        std::string acc = vectorRegister(--accumulator, 2);
+        if (avx) {
+            assembly.push_back("    vextracti128 xmm0, " + vectorRegister(accumulator, 4) + ", 1");
+            assembly.push_back("    vpaddq xmm0, xmm0, " + acc);
+            assembly.push_back("    vpshufd xmm1, xmm0, 0x4E");
+            assembly.push_back("    vpaddq xmm0, xmm0, xmm1");
+            assembly.push_back("    vmovq rax, xmm0");
+        } else {
+            assembly.push_back("    pshufd xmm0, " + acc + ", 0x4E");
+            assembly.push_back("    paddq xmm0, " + acc);
+            assembly.push_back("    movq rax, xmm0");
+        }
+        assembly.push_back("    add " + variableOperand(let->name) + ", rax");
+    }
+}
+
+// Evaluates expr for `width` consecutive values of the counter (in rcx)
+// and returns the vector register holding the result: reg, using the
+// registers above it as scratch, or an invariant's broadcast register.
+std::string CodeGenerator::generateVectorExpr(const Expr& expr, const VectorLoop& loop, int reg, int width) {
+    bool avx = width == 4;
+    std::string r = vectorRegister(reg, width);
+    
+    if (auto index = dynamic_cast<const IndexExpr*>(&expr)) {
+        assembly.push_back(std::string(avx ? "    vmovdqu " : "    movdqu ") + r + ", " +
+                           elementAddress(index->name, "rcx"));
+        return r;
+    }
+    
+    auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+    if (!bin) {
+        // Loop invariants were broadcast before the loop, just below the
+        // accumulators
+        int invariantRegister = VECTOR_REGISTER_COUNT - loop.reductionCount - static_cast<int>(loop.invariants.size());
+        for (const Expr* invariant : loop.invariants) {
+            if (sameInvariant(*invariant, expr)) {
+                break;
+            }
+            invariantRegister++;
+        }
+        return vectorRegister(invariantRegister, width);
+    }
+    
+    std::string a = generateVectorExpr(*bin->left, loop, reg, width);
+    std::string b = generateVectorExpr(*bin->right, loop, reg + 1, width);
+    
+    // SSE2 operations overwrite their first operand, so an invariant left
+    // operand is copied into reg first
+    if (!avx && a != r) {
+        assembly.push_back("    movdqa " + r + ", " + a);
+        a = r;
+    }
+    
+    if (bin->op == TokenType::PLUS || bin->op == TokenType::MINUS) {
+        std::string op = bin->op == TokenType::PLUS ? "paddq" : "psubq";
+        assembly.push_back(avx ? "    v" + op + " " + r + ", " + a + ", " + b : "    " + op + " " + r + ", " + b);
+        return r;
+    }
+    
+    // No packed 64-bit multiply below AVX-512, so build the low 64 bits
+    // from 32x32->64 products: lo*lo + ((hi*lo + lo*hi) << 32)
+    std::string t1 = vectorRegister(reg + 2, width);
+    std::string t2 = vectorRegister(reg + 3, width);
+    if (avx) {
+        assembly.push_back("    vpsrlq " + t1 + ", " + a + ", 32");
+        assembly.push_back("    vpmuludq " + t1 + ", " + t1 + ", " + b);
+        assembly.push_back("    vpsrlq " + t2 + ", " + b + ", 32");
+        assembly.push_back("    vpmuludq " + t2 + ", " + t2 + ", " + a);
+        assembly.push_back("    vpaddq " + t1 + ", " + t1 + ", " + t2);
+        assembly.push_back("    vpsllq " + t1 + ", " + t1 + ", 32");
+        assembly.push_back("    vpmuludq " + r + ", " + a + ", " + b);
+        assembly.push_back("    vpaddq " + r + ", " + r + ", " + t1);
+    } else {
+        assembly.push_back("    movdqa " + t1 + ", " + r);
+        assembly.push_back("    psrlq " + t1 + ", 32");
+        assembly.push_back("    pmuludq " + t1 + ", " + b);
+        assembly.push_back("    movdqa " + t2 + ", " + b);
+        assembly.push_back("    psrlq " + t2 + ", 32");
+        assembly.push_back("    pmuludq " + t2 + ", " + r);
+        assembly.push_back("    paddq " + t1 + ", " + t2);
+        assembly.push_back("    psllq " + t1 + ", 32");
+        assembly.push_back("    pmuludq " + r + ", " + b);
+        assembly.push_back("    paddq " + r + ", " + t1);
+    }
+    return r;
+}
+
+// Sets __cpu_has_avx2 when the CPU supports AVX2 and the OS saves YMM
+// state; vectorized loops fall back to SSE2 otherwise.
+std::vector<std::string> CodeGenerator::cpuDispatchSetup() {
+    std::string noAvx2Label = newLabel("no_avx2");
+    return {
+        "    mov eax, 1",
+        "    cpuid",
+        "    and ecx, 0x18000000", // OSXSAVE | AVX
+        "    cmp ecx, 0x18000000",
+        "    jne " + noAvx2Label,
+        "    xor ecx, ecx",
+        "    xgetbv",
+        "    and eax, 6", // XMM | YMM state enabled
+        "    cmp eax, 6",
+        "    jne " + noAvx2Label,
+        "    mov eax, 7",
+        "    xor ecx, ecx",
+        "    cpuid",
+        "    test ebx, 32", // AVX2
+        "    jz " + noAvx2Label,
+        "    mov BYTE [rel __cpu_has_avx2], 1",
+        noAvx2Label + ":",
+    };
+}
+
+// Jumps to label when condition is non-zero (jumpIfTrue) or zero.
+// Comparisons branch on the cmp flags directly instead of materializing
+// a 0/1 value first.
+void CodeGenerator::generateBranch(const Expr& condition, const std::string& label, bool jumpIfTrue) {
+    auto comparison = dynamic_cast<const BinaryExpr*>(&condition);
+    if (comparison && isComparison(comparison->op)) {
+        TokenType op = generateCompare(*comparison);
+        assembly.push_back("    j" + conditionCode(op, !jumpIfTrue) + " " + label);
+        return;
+    }
+    
+    generateExpr(condition);
+    assembly.push_back("    pop rax");
+    assembly.push_back("    test rax, rax");
+    assembly.push_back(std::string(jumpIfTrue ? "    jnz " : "    jz ") + label);
+}
+
+// Emits a cmp for the comparison and returns the operator the flags now
+// answer, which is swapped when the constant was on the left.
+TokenType CodeGenerator::generateCompare(const BinaryExpr& comparison) {
+    TokenType op = comparison.op;
+    const Expr* left = comparison.left.get();
+    const Expr* right = comparison.right.get();
+    
+    if (dynamic_cast<const NumberExpr*>(left) && !dynamic_cast<const NumberExpr*>(right)) {
+        std::swap(left, right);
+        op = swapComparison(op);
+    }
+    
+    if (auto constant = dynamic_cast<const NumberExpr*>(right)) {
+        std::string immediate = std::to_string(constant->value);
+        if (auto id = dynamic_cast<const IdentifierExpr*>(left)) {
+            assembly.push_back("    cmp " + variableOperand(id->name) + ", " + immediate);
+        } else {
+            generateExpr(*left);
+            assembly.push_back("    pop rax");
+            assembly.push_back("    cmp rax, " + immediate);
+        }
+        return op;
+    }
+    
+    generateExpr(*left);
+    generateExpr(*right);
+    assembly.push_back("    pop rbx");
+    assembly.push_back("    pop rax");
+    assembly.push_back("    cmp rax, rbx");
+    return op;
+}
+
+// Lowers `if (c) let x = a; else let x = b;` on an existing x to a cmov,
+// trading a possibly mispredicted branch for evaluating both values.
+// Returns false when the statement does not have that shape, or when the
+// profile shows the branch is predictable.
+bool CodeGenerator::generateConditionalMove(const IfStmt& stmt) {
+    const LetStmt* thenLet = singleLet(stmt.thenBranch.get());
+    const LetStmt* elseLet = singleLet(stmt.elseBranch.get());
+    if (!thenLet || !elseLet || thenLet->name != elseLet->name ||
+        variables.find(thenLet->name) == variables.end() ||
+        !isSpeculatableValue(*thenLet->value) || !isSpeculatableValue(*elseLet->value)) {
+        return false;
+    }
+    
+    if (profileMode == ProfileMode::USE) {
+        int counter = profileCounter(stmt);
+        uint64_t thenCount = profileCounts[counter];
+        uint64_t elseCount = profileCounts[counter + 1];
+        uint64_t total = thenCount + elseCount;
+        if (std::min(thenCount, elseCount) * 100 <= total * PREDICTABLE_BRANCH_PERCENT) {
+            return false;
+        }
+    }
+    
+    generateExpr(*thenLet->value);
+    generateExpr(*elseLet->value);
+    
+    std::string cmov;
+    auto comparison = dynamic_cast<const BinaryExpr*>(stmt.condition.get());
+    if (comparison && isComparison(comparison->op)) {
+        cmov = "    cmov" + conditionCode(generateCompare(*comparison), true);
+    } else {
+        generateExpr(*stmt.condition);
+        assembly.push_back("    pop rdx");
+        assembly.push_back("    test rdx, rdx");
+        cmov = "    cmovz";
+    }
+    
+    // pop and mov leave the flags from the test/cmp intact
+    assembly.push_back("    pop rcx");
+    assembly.push_back("    pop rax");
+    assembly.push_back(cmov + " rax, rcx");
+    assembly.push_back("    mov " + variableOperand(thenLet->name) + ", rax");
+    return true;
+}
+
+// Emits stmt into the cold area after the exit syscall, ending with a
+// jump back to resumeLabel.
+void CodeGenerator::generateColdBlock(const std::string& label, const Stmt* stmt,
+                                      const std::string& resumeLabel) {
+    std::vector<std::string> hotAssembly;
+    hotAssembly.swap(assembly);
+    int hotMarkedLine = markedLine;
+    markedLine = 0;
+    
+    assembly.push_back(label + ":");
+    generateLineMarker();
+    if (stmt) {
+        generateStmt(*stmt);
+    }
+    assembly.push_back("    jmp " + resumeLabel);
+    
+    coldAssembly.insert(coldAssembly.end(), assembly.begin(), assembly.end());
+    assembly.swap(hotAssembly);
+    markedLine = hotMarkedLine;
+}
+
+void CodeGenerator::assignProfileCounters(const Stmt& stmt) {
+    if (auto block = dynamic_cast<const BlockStmt*>(&stmt)) {
+        for (const auto& s : block->statements) {
+            assignProfileCounters(*s);
+        }
+    } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+        profileCounters[&stmt] = profileCounterCount;
+        profileCounterCount += 2;
+        assignProfileCounters(*ifStmt->thenBranch);
+        if (ifStmt->elseBranch) {
+            assignProfileCounters(*ifStmt->elseBranch);
+        }
+    } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+        profileCounters[&stmt] = profileCounterCount;
+        profileCounterCount += 2;
+        assignProfileCounters(*whileStmt->body);
+    }
+}
+
+int CodeGenerator::profileCounter(const Stmt& stmt) const {
+    auto it = profileCounters.find(&stmt);
+    return it != profileCounters.end() ? it->second : -1;
+}
+
+void CodeGenerator::generateCounterIncrement(int counter) {
+    if (profileMode != ProfileMode::GENERATE) {
+        return;
+    }
+    assembly.push_back("    inc QWORD [rel __profile_counters + " + std::to_string(counter * 8) + "]");
+}
+
+// Writes the header and counters to profilePath right before exiting.
+// A failed open loses the profile but does not change the exit status.
+void CodeGenerator::generateProfileDump() {
+    std::string skipLabel = newLabel("profile_skip");
+    
+    assembly.push_back("    mov rax, 2"); // open
+    assembly.push_back("    lea rdi, [rel __profile_path]");
+    assembly.push_back("    mov rsi, 577"); // O_WRONLY | O_CREAT | O_TRUNC
+    assembly.push_back("    mov rdx, 420"); // 0644
+    assembly.push_back("    syscall");
+    assembly.push_back("    test rax, rax");
+    assembly.push_back("    js " + skipLabel);
+    assembly.push_back("    mov rdi, rax");
+    assembly.push_back("    mov rax, 1"); // write
+    assembly.push_back("    lea rsi, [rel __profile_data]");
+    assembly.push_back("    mov rdx, " + std::to_string((profileCounterCount + 3) * 8));
+    assembly.push_back("    syscall");
+    assembly.push_back("    mov rax, 3"); // close
+    assembly.push_back("    syscall");
+    assembly.push_back(skipLabel + ":");
+}
+
+void CodeGenerator::loadProfile() {
+    std::ifstream file(profilePath, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open profile: " + profilePath);
+    }
+    
+    // Magic, program fingerprint, counter count
+    uint64_t header[3];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != PROFILE_MAGIC) {
+        throw std::runtime_error("Not a profile file: " + profilePath);
+    }
+    if (header[1] != profileFingerprint || header[2] != static_cast<uint64_t>(profileCounterCount)) {
+        throw std::runtime_error("Profile does not match source: " + profilePath);
+    }
+    
+    profileCounts.resize(profileCounterCount);
+    if (!file.read(reinterpret_cast<char*>(profileCounts.data()), profileCounterCount * sizeof(uint64_t))) {
+        throw std::runtime_error("Truncated profile: " + profilePath);
+    }
+}
+
 std::string CodeGenerator::generate(const std::vector<std::unique_ptr<Stmt>>& ast) {
+    if (profileMode != ProfileMode::NONE) {
+        for (const auto& stmt : ast) {
+            assignProfileCounters(*stmt);
+            hashStmt(profileFingerprint, stmt.get());
+        }
+        if (profileMode == ProfileMode::USE) {
+            loadProfile();
+        }
+    }
+    
     // Generate code for each statement
     for (const auto& stmt : ast) {
         generateStmt(*stmt);
     }
     
+    if (usesCpuDispatch) {
+        std::vector<std::string> setup = cpuDispatchSetup();
+        assembly.insert(assembly.begin() + frameSetupIndex, setup.begin(), setup.end());
+    }
+    
+    // Reserve the variable slots below rbp so pushes don't overwrite them
+    long long frameSize = (frameSlots * 8 + 15) / 16 * 16;
+    if (frameSize > 0) {
+        assembly.insert(assembly.begin() + frameSetupIndex, "    sub rsp, " + std::to_string(frameSize));
+    }
+    
+    if (profileMode == ProfileMode::GENERATE) {
+        generateProfileDump();
+    }
+    
     // Add epilogue
     assembly.push_back("    mov rsp, rbp");
     assembly.push_back("    pop rbp");
@@ -162,6 +1359,26 @@ std::string CodeGenerator::generate(const std::vector<std::unique_ptr<Stmt>>& as
     assembly.push_back("    xor rdi, rdi");
     assembly.push_back("    syscall");
     
+    // Out-of-line blocks go after the exit, away from the hot path
+    assembly.insert(assembly.end(), coldAssembly.begin(), coldAssembly.end());
+    
+    if (profileMode == ProfileMode::GENERATE) {
+        std::string pathBytes;
+        for (unsigned char c : profilePath) {
+            pathBytes += std::to_string(c) + ", ";
+        }
+        assembly.push_back("section .data");
+        assembly.push_back("__profile_path: db " + pathBytes + "0");
+        assembly.push_back("__profile_data: dq " + hexWord(PROFILE_MAGIC) + ", " + hexWord(profileFingerprint) +
+                           ", " + std::to_string(profileCounterCount));
+        assembly.push_back("__profile_counters: times " + std::to_string(profileCounterCount) + " dq 0");
+    }
+    
+    if (usesCpuDispatch) {
+        assembly.push_back("section .bss");
+        assembly.push_back("__cpu_has_avx2: resb 1");
+    }
+    
     // Combine all assembly lines
     std::stringstream ss;
     for (const auto& line : assembly) {
@@ -169,4 +1386,4 @@ std::string CodeGenerator::generate(const std::vector<std::unique_ptr<Stmt>>& as
     }
     
     return ss.str();
-} 
\ No newline at end of file
+}
\ No newline at end of file
@@ -2,33 +2,112 @@
 #define CODEGEN_H
 
 #include "parser.h"
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
+// Profile-guided optimization mode
+enum class ProfileMode {
+    NONE,
+    GENERATE,   // Instrument branches and loops, dump counters at exit
+    USE         // Lay out blocks from a previously dumped profile
+};
+
 class CodeGenerator {
 private:
+    // Elements of an array occupy consecutive slots; element 0 is the one
+    // furthest below rbp, at firstSlot.
+    struct ArrayInfo {
+        long long firstSlot;
+        int size;
+    };
+    
+    // A counted loop `while (i < n) { ...; let i = i + 1; }` whose other
+    // statements are IndexLetStmt stores to a[i] or LetStmt reductions
+    // `let s = s + ...;`, all reading arrays only at [i]. invariants holds
+    // one of each distinct constant or scalar the values read.
+    struct VectorLoop {
+        std::string counter;
+        const Expr* bound;
+        std::vector<const Stmt*> statements;
+        std::vector<const Expr*> invariants;
+        int reductionCount;
+    };
+    
     std::vector<std::string> assembly;
-    std::unordered_map<std::string, int> variables;
+    std::vector<std::string> coldAssembly;
+    std::unordered_map<std::string, long long> variables;
+    std::unordered_map<std::string, ArrayInfo> arrays;
+    long long frameSlots;
     int labelCounter;
+    size_t frameSetupIndex;
+    bool usesCpuDispatch;
+    
+    // Source line of the statement being generated, and the line the last
+    // %line marker mapped to
+    std::string sourceFile;
+    int currentLine;
+    int markedLine;
+    
+    // Each IfStmt owns two counters (then, else) and each WhileStmt two
+    // (entries, back-edges), numbered in source order.
+    ProfileMode profileMode;
+    std::string profilePath;
+    std::unordered_map<const Stmt*, int> profileCounters;
+    int profileCounterCount;
+    uint64_t profileFingerprint;
+    std::vector<uint64_t> profileCounts;
     
     void generateExpr(const Expr& expr);
     void generateStmt(const Stmt& stmt);
     
     void generateNumberExpr(const NumberExpr& expr);
     void generateIdentifierExpr(const IdentifierExpr& expr);
+    void generateIndexExpr(const IndexExpr& expr);
     void generateBinaryExpr(const BinaryExpr& expr);
+    bool generateImmediateBinaryExpr(const BinaryExpr& expr);
+    void generateMultiplyByConstant(long long multiplier);
+    void generateDivideByConstant(long long divisor);
     
     void generateLetStmt(const LetStmt& stmt);
+    void generateArrayLetStmt(const ArrayLetStmt& stmt);
+    void generateIndexLetStmt(const IndexLetStmt& stmt);
     void generateExprStmt(const ExprStmt& stmt);
     void generateBlockStmt(const BlockStmt& stmt);
     void generateIfStmt(const IfStmt& stmt);
     void generateWhileStmt(const WhileStmt& stmt);
+    void generateRotatedWhileStmt(const WhileStmt& stmt, int unrollFactor);
+    
+    bool matchVectorLoop(const WhileStmt& stmt, VectorLoop& loop) const;
+    bool isVectorizableExpr(const Expr& expr, const VectorLoop& loop) const;
+    void generateVectorLoop(const VectorLoop& loop);
+    void generateVectorBody(const VectorLoop& loop, int width);
+    std::string generateVectorExpr(const Expr& expr, const VectorLoop& loop, int reg, int width);
+    std::vector<std::string> cpuDispatchSetup();
+    
+    void generateBranch(const Expr& condition, const std::string& label, bool jumpIfTrue);
+    TokenType generateCompare(const BinaryExpr& comparison);
+    bool generateConditionalMove(const IfStmt& stmt);
+    std::string variableOperand(const std::string& name) const;
+    const ArrayInfo& arrayInfo(const std::string& name) const;
+    std::string elementAddress(const std::string& name, const std::string& indexRegister) const;
+    void generateColdBlock(const std::string& label, const Stmt* stmt, const std::string& resumeLabel);
+    
+    void assignProfileCounters(const Stmt& stmt);
+    int profileCounter(const Stmt& stmt) const;
+    void generateCounterIncrement(int counter);
+    void generateProfileDump();
+    void loadProfile();
     
-    std::string newLabel();
+    long long allocateFrameSlots(long long count, const std::string& name);
+    std::string newLabel(const std::string& role);
+    void generateLineMarker();
     
 public:
     CodeGenerator();
+    void setProfileMode(ProfileMode mode, const std::string& path);
+    void setSourceFile(const std::string& path);
     std::string generate(const std::vector<std::unique_ptr<Stmt>>& ast);
 };
 
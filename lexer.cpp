@@ -88,6 +88,8 @@ Token Lexer::readOperator() {
         case ')': return Token(TokenType::RPAREN, ")", line, column);
         case '{': return Token(TokenType::LBRACE, "{", line, column);
         case '}': return Token(TokenType::RBRACE, "}", line, column);
+        case '[': return Token(TokenType::LBRACKET, "[", line, column);
+        case ']': return Token(TokenType::RBRACKET, "]", line, column);
         case ';': return Token(TokenType::SEMICOLON, ";", line, column);
         case ',': return Token(TokenType::COMMA, ",", line, column);
         default: return Token(TokenType::INVALID, std::string(1, c), line, column);
@@ -123,8 +125,4 @@ std::vector<Token> Lexer::tokenize() {
     
     tokens.push_back(token); // Add EOF token
     return tokens;
-}
-
-int main(){
-    cout<<"Hello world";
 }
\ No newline at end of file
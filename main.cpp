@@ -1,6 +1,10 @@
 #include "lexer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "memtrack.h"
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -24,39 +28,164 @@ void writeFile(const std::string& filename, const std::string& content) {
     file << content;
 }
 
+// Matches "--name" or "--name=value", storing value (or "") on success
+bool matchOption(const std::string& arg, const std::string& name, std::string& value) {
+    if (arg == name) {
+        value.clear();
+        return true;
+    }
+    if (arg.rfind(name + "=", 0) == 0) {
+        value = arg.substr(name.size() + 1);
+        return true;
+    }
+    return false;
+}
+
+// Parses a byte count with an optional K, M or G suffix, returning 0 if
+// the text is not one
+size_t parseByteSize(const std::string& text) {
+    size_t digits = 0;
+    while (digits < text.size() && isdigit(static_cast<unsigned char>(text[digits]))) {
+        digits++;
+    }
+    if (digits == 0 || digits > 15 || text.size() > digits + 1) {
+        return 0;
+    }
+    
+    size_t bytes = std::stoull(text.substr(0, digits));
+    int shift = 0;
+    if (digits < text.size()) {
+        switch (toupper(static_cast<unsigned char>(text[digits]))) {
+            case 'K': shift = 10; break;
+            case 'M': shift = 20; break;
+            case 'G': shift = 30; break;
+            default: return 0;
+        }
+    }
+    if (bytes > (SIZE_MAX >> shift)) {
+        return 0;
+    }
+    return bytes << shift;
+}
+
+// Library code can swallow the exception for a refused allocation (iostream
+// inserters do), leaving truncated output behind, so check between phases
+void checkMemoryBudget() {
+    if (MemoryTracker::budgetExceeded()) {
+        throw MemoryTracker::budgetFailure();
+    }
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] <source_file>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --profile-generate[=<file>]  Instrument the executable to write a profile" << std::endl;
+    std::cerr << "  --profile-use[=<file>]       Optimize block layout using a profile" << std::endl;
+    std::cerr << "  --max-memory=<bytes>[K|M|G]  Fail once the compiler's heap exceeds this size" << std::endl;
+    std::cerr << "  --memory-report              Print heap usage per compiler subsystem" << std::endl;
+    std::cerr << "The executable is <source_file> without its extension (<source_file>.out if it has none)," << std::endl;
+    std::cerr << "and the profile file defaults to <executable>.prof" << std::endl;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <source_file>" << std::endl;
+    std::string sourceFile;
+    ProfileMode profileMode = ProfileMode::NONE;
+    std::string profilePath;
+    std::string maxMemory;
+    size_t memoryBudget = 0;
+    bool memoryReport = false;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (matchOption(arg, "--profile-generate", profilePath)) {
+            profileMode = ProfileMode::GENERATE;
+        } else if (matchOption(arg, "--profile-use", profilePath)) {
+            profileMode = ProfileMode::USE;
+        } else if (matchOption(arg, "--max-memory", maxMemory)) {
+            memoryBudget = parseByteSize(maxMemory);
+            if (memoryBudget == 0) {
+                std::cerr << "Invalid memory size: " << maxMemory << std::endl;
+                return 1;
+            }
+        } else if (arg == "--memory-report") {
+            memoryReport = true;
+        } else if (sourceFile.empty() && arg.rfind("--", 0) != 0) {
+            sourceFile = arg;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (sourceFile.empty()) {
+        printUsage(argv[0]);
         return 1;
     }
     
+    // Never link over the source: a profile-guided build compiles it twice
+    std::string executable = std::filesystem::path(sourceFile).replace_extension("").string();
+    if (executable == sourceFile) {
+        executable += ".out";
+    }
+    
     try {
+        // Enforced only from here, where exceeding it is caught and reported
+        MemoryTracker::setBudget(memoryBudget);
+        
         // Read source file
-        std::string source = readFile(argv[1]);
+        std::string source = readFile(sourceFile);
         
         // Lexical analysis
-        Lexer lexer(source);
-        std::vector<Token> tokens = lexer.tokenize();
+        std::vector<Token> tokens;
+        {
+            MemoryScope scope(MemorySubsystem::LEXER);
+            Lexer lexer(source);
+            tokens = lexer.tokenize();
+        }
+        checkMemoryBudget();
         
         // Parsing
-        Parser parser(tokens);
-        auto ast = parser.parse();
+        std::vector<std::unique_ptr<Stmt>> ast;
+        {
+            MemoryScope scope(MemorySubsystem::PARSER);
+            Parser parser(tokens);
+            ast = parser.parse();
+        }
+        checkMemoryBudget();
         
         // Code generation
-        CodeGenerator codegen;
-        std::string assembly = codegen.generate(ast);
+        std::string assembly;
+        {
+            MemoryScope scope(MemorySubsystem::CODEGEN);
+            CodeGenerator codegen;
+            // Line info lets perf annotate/report map samples back to the source
+            codegen.setSourceFile(std::filesystem::absolute(sourceFile).string());
+            if (profileMode != ProfileMode::NONE) {
+                if (profilePath.empty()) {
+                    profilePath = executable + ".prof";
+                }
+                // The instrumented executable may run from any directory
+                codegen.setProfileMode(profileMode, std::filesystem::absolute(profilePath).string());
+            }
+            assembly = codegen.generate(ast);
+        }
+        checkMemoryBudget();
+        
+        if (memoryReport) {
+            MemoryTracker::printReport(std::cerr);
+        }
         
         // Write assembly to file
-        std::string outputFile = std::string(argv[1]) + ".asm";
+        checkMemoryBudget();
+        std::string outputFile = sourceFile + ".asm";
         writeFile(outputFile, assembly);
         
         std::cout << "Compilation successful. Assembly written to " << outputFile << std::endl;
         
         // Assemble and link
-        std::string objectFile = std::string(argv[1]) + ".o";
-        std::string executable = std::string(argv[1]);
+        std::string objectFile = sourceFile + ".o";
         
-        std::string assembleCmd = "nasm -f elf64 " + outputFile + " -o " + objectFile;
+        std::string assembleCmd = "nasm -f elf64 -g -F dwarf " + outputFile + " -o " + objectFile;
         std::string linkCmd = "ld " + objectFile + " -o " + executable;
         
         system(assembleCmd.c_str());
@@ -64,7 +193,13 @@ int main(int argc, char* argv[]) {
         
         std::cout << "Executable created: " << executable << std::endl;
         
+    } catch (const MemoryBudgetExceeded& e) {
+        MemoryTracker::setBudget(0); // Let error reporting allocate
+        std::cerr << "Error: " << e.what() << std::endl;
+        MemoryTracker::printReport(std::cerr);
+        return 1;
     } catch (const std::exception& e) {
+        MemoryTracker::setBudget(0);
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
@@ -0,0 +1,224 @@
+#include "memtrack.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+
+namespace {
+
+struct SubsystemCounters {
+    size_t liveBytes;
+    size_t peakBytes;
+    size_t allocations;
+    size_t totalBytes;
+};
+
+// Every block starts with a header recording what to uncharge on free.
+// 16 bytes keeps the memory handed out aligned like malloc's.
+struct AllocationHeader {
+    size_t size;
+    MemorySubsystem subsystem;
+};
+const size_t HEADER_SIZE = 16;
+static_assert(sizeof(AllocationHeader) <= HEADER_SIZE, "allocation header too large");
+
+// Zero-initialized before any constructor runs, so allocations made during
+// static initialization are counted too
+SubsystemCounters counters[static_cast<int>(MemorySubsystem::COUNT)];
+size_t totalLiveBytes;
+size_t totalPeakBytes;
+size_t budgetBytes;
+MemorySubsystem currentSubsystem = MemorySubsystem::OTHER;
+
+// The latest allocation refused for exceeding the budget, and the counters
+// as they stood then, before unwinding freed everything
+bool budgetOverrun;
+size_t failureBudget;
+size_t failureRequested;
+MemorySubsystem failureSubsystem;
+SubsystemCounters failureCounters[static_cast<int>(MemorySubsystem::COUNT)];
+size_t failureLiveBytes;
+
+bool exceedsBudget(size_t size) {
+    return budgetBytes != 0 && totalLiveBytes + size > budgetBytes;
+}
+
+// Allocates and charges a block, returning nullptr if malloc fails
+void* allocateBlock(size_t size, MemorySubsystem subsystem) {
+    void* block = std::malloc(HEADER_SIZE + size);
+    if (!block) {
+        return nullptr;
+    }
+    
+    auto header = static_cast<AllocationHeader*>(block);
+    header->size = size;
+    header->subsystem = subsystem;
+    
+    SubsystemCounters& c = counters[static_cast<int>(subsystem)];
+    c.liveBytes += size;
+    c.allocations++;
+    c.totalBytes += size;
+    if (c.liveBytes > c.peakBytes) {
+        c.peakBytes = c.liveBytes;
+    }
+    totalLiveBytes += size;
+    if (totalLiveBytes > totalPeakBytes) {
+        totalPeakBytes = totalLiveBytes;
+    }
+    
+    return static_cast<char*>(block) + HEADER_SIZE;
+}
+
+} // namespace
+
+MemoryBudgetExceeded::MemoryBudgetExceeded(size_t budget, size_t requested, MemorySubsystem subsystem) {
+    // Formatted into a fixed buffer: allocating here would recurse
+    std::snprintf(message, sizeof(message),
+                  "Memory budget of %zu bytes exceeded by a %zu byte allocation in %s",
+                  budget, requested, MemoryTracker::subsystemName(subsystem));
+}
+
+const char* MemoryBudgetExceeded::what() const noexcept {
+    return message;
+}
+
+// The budget stays in force after a refusal: the exception may be swallowed
+// (iostream inserters do), so the caller checks budgetExceeded() and lifts
+// the budget itself before reporting
+void* MemoryTracker::allocate(size_t size, MemorySubsystem subsystem) {
+    if (exceedsBudget(size)) {
+        budgetOverrun = true;
+        failureBudget = budgetBytes;
+        failureRequested = size;
+        failureSubsystem = subsystem;
+        for (int i = 0; i < static_cast<int>(MemorySubsystem::COUNT); i++) {
+            failureCounters[i] = counters[i];
+        }
+        failureLiveBytes = totalLiveBytes;
+        throw budgetFailure();
+    }
+    
+    void* ptr = allocateBlock(size, subsystem);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+// For nothrow new: a refused allocation just returns nullptr and leaves the
+// budget and failure snapshot alone, since the caller handles it
+void* MemoryTracker::tryAllocate(size_t size, MemorySubsystem subsystem) noexcept {
+    if (exceedsBudget(size)) {
+        return nullptr;
+    }
+    return allocateBlock(size, subsystem);
+}
+
+void MemoryTracker::deallocate(void* ptr) noexcept {
+    if (!ptr) {
+        return;
+    }
+    
+    void* block = static_cast<char*>(ptr) - HEADER_SIZE;
+    auto header = static_cast<AllocationHeader*>(block);
+    counters[static_cast<int>(header->subsystem)].liveBytes -= header->size;
+    totalLiveBytes -= header->size;
+    std::free(block);
+}
+
+void MemoryTracker::setBudget(size_t bytes) {
+    budgetBytes = bytes;
+}
+
+bool MemoryTracker::budgetExceeded() {
+    return budgetOverrun;
+}
+
+MemoryBudgetExceeded MemoryTracker::budgetFailure() {
+    return MemoryBudgetExceeded(failureBudget, failureRequested, failureSubsystem);
+}
+
+const char* MemoryTracker::subsystemName(MemorySubsystem subsystem) {
+    switch (subsystem) {
+        case MemorySubsystem::LEXER: return "lexer";
+        case MemorySubsystem::PARSER: return "parser";
+        case MemorySubsystem::AST: return "ast";
+        case MemorySubsystem::CODEGEN: return "codegen";
+        default: return "other";
+    }
+}
+
+void MemoryTracker::printReport(std::ostream& out) {
+    // Snapshot first so the report's own allocations don't show up in it
+    SubsystemCounters snapshot[static_cast<int>(MemorySubsystem::COUNT)];
+    for (int i = 0; i < static_cast<int>(MemorySubsystem::COUNT); i++) {
+        snapshot[i] = budgetOverrun ? failureCounters[i] : counters[i];
+    }
+    size_t liveBytes = budgetOverrun ? failureLiveBytes : totalLiveBytes;
+    size_t peakBytes = totalPeakBytes;
+    
+    if (budgetOverrun) {
+        out << "Memory usage by subsystem when the budget was exceeded (bytes):" << std::endl;
+    } else {
+        out << "Memory usage by subsystem (bytes):" << std::endl;
+    }
+    out << std::left << std::setw(10) << "subsystem" << std::right
+        << std::setw(14) << "live" << std::setw(14) << "peak"
+        << std::setw(14) << "allocations" << std::setw(16) << "total allocated" << std::endl;
+    for (int i = 0; i < static_cast<int>(MemorySubsystem::COUNT); i++) {
+        const SubsystemCounters& c = snapshot[i];
+        out << std::left << std::setw(10) << subsystemName(static_cast<MemorySubsystem>(i)) << std::right
+            << std::setw(14) << c.liveBytes << std::setw(14) << c.peakBytes
+            << std::setw(14) << c.allocations << std::setw(16) << c.totalBytes << std::endl;
+    }
+    out << std::left << std::setw(10) << "total" << std::right
+        << std::setw(14) << liveBytes << std::setw(14) << peakBytes << std::endl;
+}
+
+MemoryScope::MemoryScope(MemorySubsystem subsystem) : previous(currentSubsystem) {
+    currentSubsystem = subsystem;
+}
+
+MemoryScope::~MemoryScope() {
+    currentSubsystem = previous;
+}
+
+// Route every global allocation through the tracker
+void* operator new(size_t size) {
+    return MemoryTracker::allocate(size, currentSubsystem);
+}
+
+void* operator new[](size_t size) {
+    return MemoryTracker::allocate(size, currentSubsystem);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return MemoryTracker::tryAllocate(size, currentSubsystem);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return MemoryTracker::tryAllocate(size, currentSubsystem);
+}
+
+void operator delete(void* ptr) noexcept {
+    MemoryTracker::deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    MemoryTracker::deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    MemoryTracker::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    MemoryTracker::deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    MemoryTracker::deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    MemoryTracker::deallocate(ptr);
+}
@@ -0,0 +1,63 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <cstddef>
+#include <new>
+#include <ostream>
+
+// Compiler subsystems that heap allocations are charged to
+enum class MemorySubsystem {
+    OTHER,
+    LEXER,
+    PARSER,
+    AST,
+    CODEGEN,
+    COUNT
+};
+
+// Thrown by operator new when an allocation would take the live heap
+// over the budget set with MemoryTracker::setBudget
+class MemoryBudgetExceeded : public std::bad_alloc {
+private:
+    char message[160];
+    
+public:
+    MemoryBudgetExceeded(size_t budget, size_t requested, MemorySubsystem subsystem);
+    const char* what() const noexcept override;
+};
+
+// Counts every heap allocation made through operator new. Allocations are
+// charged to the subsystem of the innermost MemoryScope, except AST nodes,
+// which are always charged to AST. The compiler is single-threaded, so the
+// counters are plain globals.
+class MemoryTracker {
+public:
+    static void* allocate(size_t size, MemorySubsystem subsystem);
+    static void* tryAllocate(size_t size, MemorySubsystem subsystem) noexcept;
+    static void deallocate(void* ptr) noexcept;
+    
+    static void setBudget(size_t bytes); // 0 means unlimited
+    
+    // Whether any allocation has been refused, even if the exception was
+    // swallowed, and the error describing the latest one
+    static bool budgetExceeded();
+    static MemoryBudgetExceeded budgetFailure();
+    static void printReport(std::ostream& out);
+    
+    static const char* subsystemName(MemorySubsystem subsystem);
+};
+
+// Charges allocations made during its lifetime to a subsystem
+class MemoryScope {
+private:
+    MemorySubsystem previous;
+    
+public:
+    explicit MemoryScope(MemorySubsystem subsystem);
+    ~MemoryScope();
+    
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+};
+
+#endif // MEMTRACK_H
@@ -47,11 +47,17 @@ std::vector<std::unique_ptr<Stmt>> Parser::parse() {
 }
 
 std::unique_ptr<Stmt> Parser::statement() {
-    if (match(TokenType::LET)) return letStatement();
-    if (match(TokenType::IF)) return ifStatement();
-    if (match(TokenType::WHILE)) return whileStatement();
-    if (match(TokenType::LBRACE)) return blockStatement();
-    return std::make_unique<ExprStmt>(expression());
+    int line = peek().line;
+    std::unique_ptr<Stmt> stmt;
+    
+    if (match(TokenType::LET)) stmt = letStatement();
+    else if (match(TokenType::IF)) stmt = ifStatement();
+    else if (match(TokenType::WHILE)) stmt = whileStatement();
+    else if (match(TokenType::LBRACE)) stmt = blockStatement();
+    else stmt = std::make_unique<ExprStmt>(expression());
+    
+    stmt->line = line;
+    return stmt;
 }
 
 std::unique_ptr<Stmt> Parser::letStatement() {
@@ -60,6 +66,10 @@ std::unique_ptr<Stmt> Parser::letStatement() {
         error("Expected identifier after 'let'");
     }
     
+    if (match(TokenType::LBRACKET)) {
+        return arrayLetStatement(name);
+    }
+    
     if (!match(TokenType::ASSIGN)) {
         error("Expected '=' after identifier");
     }
@@ -72,6 +82,32 @@ std::unique_ptr<Stmt> Parser::letStatement() {
     return std::make_unique<LetStmt>(name.value, std::move(value));
 }
 
+std::unique_ptr<Stmt> Parser::arrayLetStatement(const Token& name) {
+    auto index = expression();
+    if (!match(TokenType::RBRACKET)) {
+        error("Expected ']' after index");
+    }
+    
+    if (match(TokenType::SEMICOLON)) {
+        auto size = dynamic_cast<NumberExpr*>(index.get());
+        if (!size || size->value <= 0) {
+            error("Array size must be a positive number");
+        }
+        return std::make_unique<ArrayLetStmt>(name.value, size->value);
+    }
+    
+    if (!match(TokenType::ASSIGN)) {
+        error("Expected '=' or ';' after ']'");
+    }
+    
+    auto value = expression();
+    if (!match(TokenType::SEMICOLON)) {
+        error("Expected ';' after value");
+    }
+    
+    return std::make_unique<IndexLetStmt>(name.value, std::move(index), std::move(value));
+}
+
 std::unique_ptr<Stmt> Parser::ifStatement() {
     if (!match(TokenType::LPAREN)) {
         error("Expected '(' after 'if'");
@@ -180,7 +216,15 @@ std::unique_ptr<Expr> Parser::primary() {
     }
     
     if (match(TokenType::IDENTIFIER)) {
-        return std::make_unique<IdentifierExpr>(previous().value);
+        std::string name = previous().value;
+        if (match(TokenType::LBRACKET)) {
+            auto index = expression();
+            if (!match(TokenType::RBRACKET)) {
+                error("Expected ']' after index");
+            }
+            return std::make_unique<IndexExpr>(name, std::move(index));
+        }
+        return std::make_unique<IdentifierExpr>(name);
     }
     
     if (match(TokenType::LPAREN)) {
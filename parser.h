@@ -2,6 +2,7 @@
 #define PARSER_H
 
 #include "lexer.h"
+#include "memtrack.h"
 #include <memory>
 #include <vector>
 
@@ -13,6 +14,10 @@ class Stmt;
 class Expr {
 public:
     virtual ~Expr() = default;
+    
+    // Nodes are charged to the AST whichever phase creates them
+    static void* operator new(size_t size) { return MemoryTracker::allocate(size, MemorySubsystem::AST); }
+    static void operator delete(void* ptr) { MemoryTracker::deallocate(ptr); }
 };
 
 class NumberExpr : public Expr {
@@ -27,6 +32,15 @@ public:
     IdentifierExpr(const std::string& name) : name(name) {}
 };
 
+class IndexExpr : public Expr {
+public:
+    std::string name;
+    std::unique_ptr<Expr> index;
+    
+    IndexExpr(const std::string& name, std::unique_ptr<Expr> index)
+        : name(name), index(std::move(index)) {}
+};
+
 class BinaryExpr : public Expr {
 public:
     TokenType op;
@@ -40,7 +54,11 @@ public:
 // Statement types
 class Stmt {
 public:
+    int line = 0; // Source line of the statement's first token
     virtual ~Stmt() = default;
+    
+    static void* operator new(size_t size) { return MemoryTracker::allocate(size, MemorySubsystem::AST); }
+    static void operator delete(void* ptr) { MemoryTracker::deallocate(ptr); }
 };
 
 class LetStmt : public Stmt {
@@ -52,6 +70,26 @@ public:
         : name(name), value(std::move(value)) {}
 };
 
+// let name[size]; declares a zero-filled integer array
+class ArrayLetStmt : public Stmt {
+public:
+    std::string name;
+    int size;
+    
+    ArrayLetStmt(const std::string& name, int size) : name(name), size(size) {}
+};
+
+// let name[index] = value; stores one array element
+class IndexLetStmt : public Stmt {
+public:
+    std::string name;
+    std::unique_ptr<Expr> index;
+    std::unique_ptr<Expr> value;
+    
+    IndexLetStmt(const std::string& name, std::unique_ptr<Expr> index, std::unique_ptr<Expr> value)
+        : name(name), index(std::move(index)), value(std::move(value)) {}
+};
+
 class ExprStmt : public Stmt {
 public:
     std::unique_ptr<Expr> expr;
@@ -110,6 +148,7 @@ private:
     
     std::unique_ptr<Stmt> statement();
     std::unique_ptr<Stmt> letStatement();
+    std::unique_ptr<Stmt> arrayLetStatement(const Token& name);
     std::unique_ptr<Stmt> ifStatement();
     std::unique_ptr<Stmt> whileStatement();
     std::unique_ptr<Stmt> blockStatement();